@@ -0,0 +1,29 @@
+#include <pathwatch.h>
+
+#include <iostream>
+
+#ifdef __linux__
+#include <pw_broker.h>
+#endif
+
+int main(int argc, char** argv) {
+#ifdef __linux__
+    if (argc > 2) {
+        std::cout << "Usage " << argv[0] << " [/path/to/broker.sock]" << std::endl;
+        return 0;
+    }
+
+    auto socket = argc == 2 ? pathwatch::fs::path(argv[1]) : pathwatch::broker::defaultSocket();
+
+    pathwatch::Broker broker(socket);
+
+    std::cout << "Broker listening on " << socket.string() << std::endl;
+    std::cout << "Run clients with PATHWATCH_BROKER=" << socket.string() << std::endl;
+    std::cout << "Press any key to exit" << std::endl;
+    std::cin.get();
+#else
+    (void)argc;
+    std::cout << argv[0] << ": the PathWatch broker is only available on Linux" << std::endl;
+#endif
+    return 0;
+}
@@ -4,10 +4,15 @@
 
 #include "pw_api.h"
 
+#include <chrono>
 #include <filesystem>
 #include <memory>
 #include <string>
 #include <functional>
+#include <new>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 #include <variant>
 
@@ -41,52 +46,221 @@ struct PW_API FileRenamed {
 };
 }  // namespace actions
 
+/**
+ * Type-erased holder for the callable given to PathWatcher::watch. The callable is stored once,
+ * inline when it is small enough and nothrow movable, otherwise on the heap. Each action is
+ * dispatched through a single indirect call.
+ */
 struct PW_API CallbackWrapper {
+    template <typename Callback,
+              typename = std::enable_if_t<!std::is_same_v<std::decay_t<Callback>, CallbackWrapper>>>
+    CallbackWrapper(Callback callback) {
+        using Impl = Model<Callback, fitsInline<Callback>()>;
+        Impl::create(&storage_, std::move(callback));
+        ops_ = &Impl::ops;
+    }
+    CallbackWrapper(const CallbackWrapper& rhs) : ops_{rhs.ops_} {
+        if (ops_) ops_->copy(&rhs.storage_, &storage_);
+    }
+    CallbackWrapper(CallbackWrapper&& rhs) noexcept : ops_{rhs.ops_} {
+        if (ops_) ops_->move(&rhs.storage_, &storage_);
+        rhs.ops_ = nullptr;
+    }
+    CallbackWrapper& operator=(const CallbackWrapper& rhs) {
+        if (this != &rhs) {
+            CallbackWrapper tmp{rhs};
+            *this = std::move(tmp);
+        }
+        return *this;
+    }
+    CallbackWrapper& operator=(CallbackWrapper&& rhs) noexcept {
+        if (this != &rhs) {
+            reset();
+            ops_ = rhs.ops_;
+            if (ops_) ops_->move(&rhs.storage_, &storage_);
+            rhs.ops_ = nullptr;
+        }
+        return *this;
+    }
+    ~CallbackWrapper() { reset(); }
+
+    void operator()(actions::FileAdded f) { ops_->onFileAdded(&storage_, std::move(f)); }
+    void operator()(actions::FileRemoved f) { ops_->onFileRemoved(&storage_, std::move(f)); }
+    void operator()(actions::FileModified f) { ops_->onFileModified(&storage_, std::move(f)); }
+    void operator()(actions::FileRenamed f) { ops_->onFileRenamed(&storage_, std::move(f)); }
+
+    /**
+     * True if the callable is stored in the wrapper itself rather than on the heap.
+     */
+    bool isInline() const { return ops_ && ops_->isInline; }
+
+private:
+    using Storage = std::aligned_storage_t<6 * sizeof(void*), alignof(std::max_align_t)>;
+
+    struct Ops {
+        void (*onFileAdded)(void*, actions::FileAdded&&);
+        void (*onFileRemoved)(void*, actions::FileRemoved&&);
+        void (*onFileModified)(void*, actions::FileModified&&);
+        void (*onFileRenamed)(void*, actions::FileRenamed&&);
+        void (*copy)(const void* src, void* dst);
+        void (*move)(void* src, void* dst) noexcept;
+        void (*destroy)(void*) noexcept;
+        bool isInline;
+    };
 
     template <typename Callback>
-    CallbackWrapper(Callback callback)
-        : onFileAdded{callback}
-        , onFileRemoved{callback}
-        , onFileModified{callback}
-        , onFileRenamed{callback} {}
-    std::function<void(actions::FileAdded)> onFileAdded;
-    std::function<void(actions::FileRemoved)> onFileRemoved;
-    std::function<void(actions::FileModified)> onFileModified;
-    std::function<void(actions::FileRenamed)> onFileRenamed;
-
-    void operator()(actions::FileAdded f) { onFileAdded(f); }
-    void operator()(actions::FileRemoved f) { onFileRemoved(f); }
-    void operator()(actions::FileModified f) { onFileModified(f); }
-    void operator()(actions::FileRenamed f) { onFileRenamed(f); }
+    static constexpr bool fitsInline() {
+        return sizeof(Callback) <= sizeof(Storage) && alignof(Storage) % alignof(Callback) == 0 &&
+               std::is_nothrow_move_constructible_v<Callback>;
+    }
+
+    template <typename Callback, bool Inline>
+    struct Model {
+        static Callback& get(void* s) {
+            if constexpr (Inline) {
+                return *static_cast<Callback*>(s);
+            } else {
+                return **static_cast<Callback**>(s);
+            }
+        }
+        static const Callback& get(const void* s) { return get(const_cast<void*>(s)); }
+
+        static void create(void* s, Callback&& callback) {
+            if constexpr (Inline) {
+                ::new (s) Callback(std::move(callback));
+            } else {
+                ::new (s) Callback*(new Callback(std::move(callback)));
+            }
+        }
+        static void copy(const void* src, void* dst) { create(dst, Callback(get(src))); }
+        static void move(void* src, void* dst) noexcept {
+            if constexpr (Inline) {
+                ::new (dst) Callback(std::move(get(src)));
+                get(src).~Callback();
+            } else {
+                ::new (dst) Callback*(*static_cast<Callback**>(src));
+            }
+        }
+        static void destroy(void* s) noexcept {
+            if constexpr (Inline) {
+                get(s).~Callback();
+            } else {
+                delete &get(s);
+            }
+        }
+
+        template <typename Action>
+        static void invoke(void* s, Action&& action) {
+            get(s)(std::move(action));
+        }
+
+        static constexpr Ops ops{&invoke<actions::FileAdded>,    &invoke<actions::FileRemoved>,
+                                 &invoke<actions::FileModified>, &invoke<actions::FileRenamed>,
+                                 &copy,
+                                 &move,
+                                 &destroy,
+                                 Inline};
+    };
+
+    void reset() noexcept {
+        if (ops_) ops_->destroy(&storage_);
+        ops_ = nullptr;
+    }
+
+    const Ops* ops_ = nullptr;
+    Storage storage_;
+};
+
+/**
+ * Recursive totals of a directory maintained by PathWatcher::index, counts regular files only.
+ * newest is fs::file_time_type::min() for a directory without files.
+ */
+struct PW_API DirectoryAggregate {
+    std::uintmax_t bytes = 0;
+    std::uintmax_t files = 0;
+    fs::file_time_type newest = fs::file_time_type::min();
 };
 
+class DirectoryIndex;
+
 class PW_API PathWatcher {
 public:
     using Action = std::variant<actions::FileAdded, actions::FileRemoved, actions::FileModified,
                                 actions::FileRenamed>;
 
-    class PIMPL {
+    /**
+     * Backend interface. The default constructor uses the native backend for the platform, any
+     * other implementation (e.g. SimulatedBackend) can be given to the PathWatcher at runtime.
+     */
+    class PW_API PIMPL {
     public:
         virtual ~PIMPL() {}
+        /**
+         * Start delivering actions for path to callback. Throws Exception if the backend can not
+         * watch the given path.
+         */
+        virtual void addWatch(fs::path path, CallbackWrapper callback) = 0;
+        /**
+         * See PathWatcher::setWatchBudget, ignored by backends without kernel watch limits.
+         */
+        virtual void setWatchBudget(size_t /*budget*/, std::chrono::milliseconds /*pollInterval*/) {}
     };
 
+    /**
+     * Uses the native backend. On Linux, if the PATHWATCH_BROKER environment variable names the
+     * socket of a running Broker, watches are shared through the broker instead.
+     */
     PathWatcher();
+    explicit PathWatcher(std::unique_ptr<PIMPL> backend);
+
+    /**
+     * Creates the backend for the current platform (inotify, ReadDirectoryChangesW or the no-op
+     * fallback).
+     */
+    static std::unique_ptr<PIMPL> nativeBackend();
     ~PathWatcher();
 
+    /**
+     * Calls callback with each action on path, or on the entries of path if it is a directory.
+     * Entries include subdirectories, their creation, removal and renames are reported like
+     * those of files. Renames within a watched directory, or between two watched directories,
+     * are a FileRenamed, moves into or out of the watched directories a FileAdded or FileRemoved.
+     */
     template <typename Callback>
     void watch(fs::path path, Callback callback) {
-
-        if (fs::is_regular_file(path) || fs::is_directory(path)) {
-            watchInternal(path, callback);
-        } else {
-            throw Exception("Given path is not a file nor a directory");
-        }
+        watchInternal(std::move(path), std::move(callback));
     }
 
+    /**
+     * Opt-in: walk dir once and from then on keep DirectoryAggregate for dir and every directory
+     * below it up to date from the actions of this watcher, watching all its subdirectories.
+     * Indexing a directory inside or above an already indexed one extends the existing index.
+     * Changes racing the initial walk may be missed until the next action on that path.
+     */
+    void index(const fs::path& dir);
+
+    /**
+     * Aggregate of an indexed directory including all its subdirectories, O(1). Throws Exception
+     * if dir is not indexed.
+     */
+    DirectoryAggregate aggregate(const fs::path& dir) const;
+
+    /**
+     * Limits the number of kernel watches held, 0 (the default) means the system limit
+     * (max_user_watches on Linux). Watches beyond the budget, or added after the kernel runs out,
+     * are demoted to stat polling every pollInterval. The least recently active kernel watches
+     * are demoted first, and polled paths that keep changing are promoted back. Polling reports
+     * renames as a removal and an addition.
+     */
+    void setWatchBudget(size_t budget,
+                        std::chrono::milliseconds pollInterval = std::chrono::seconds(2));
+
     std::unique_ptr<PIMPL> impl_;
 
 private:
     void watchInternal(fs::path, CallbackWrapper callbacks);
+
+    std::shared_ptr<DirectoryIndex> index_;  // shared with the callbacks that update it
 };
 
 }  // namespace pathwatch
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "pathwatch.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace pathwatch {
+
+namespace broker {
+struct Ring;
+/**
+ * Default per user socket path, /tmp/pathwatch-<uid>.sock
+ */
+PW_API fs::path defaultSocket();
+}  // namespace broker
+
+/**
+ * Host-local watch daemon (Linux only). The broker owns the kernel watches for all subscribing
+ * processes, each distinct path is watched once no matter how many clients ask for it. Actions
+ * are published once into an anonymous shared-memory ring buffer that every client maps read-only
+ * and reads directly, clients subscribe over a Unix-domain socket.
+ *
+ * Control protocol, one line per message:
+ *     broker -> client on connect:  HELLO <capacity>, with the ring fd attached (SCM_RIGHTS)
+ *     client -> broker:             WATCH "<absolute path>"
+ *     broker -> client:             OK <watch id>  |  ERR "<message>"
+ *
+ * Watches live as long as the broker, there is no unsubscribe.
+ */
+class PW_API Broker {
+public:
+    Broker(fs::path socket = broker::defaultSocket(), size_t capacity = 4096);
+    Broker(const Broker&) = delete;
+    Broker& operator=(const Broker&) = delete;
+    ~Broker();
+
+    size_t numberOfWatches() const;
+
+private:
+    void loop();
+    std::string handle(const std::string& line);
+    void publish(uint32_t id, const PathWatcher::Action& action);
+
+    fs::path socket_;
+    size_t capacity_;
+    int shmFd_ = -1;
+    broker::Ring* ring_ = nullptr;
+    size_t ringSize_ = 0;
+    std::mutex publishMutex_;
+
+    int listenFd_ = -1;
+    int stopPipe_[2] = {-1, -1};
+
+    mutable std::mutex watchMutex_;
+    std::unordered_map<std::string, uint32_t> watchIds_;
+
+    std::unique_ptr<PathWatcher> watcher_;
+    std::thread thread_;  // init thread last
+};
+
+/**
+ * Backend that subscribes to a running Broker. Callbacks are invoked from a reader thread that
+ * follows the shared ring buffer. If the broker goes away, all watches move to a native backend,
+ * actions between the broker exiting and the fallback are lost.
+ */
+class PW_API BrokerBackend : public PathWatcher::PIMPL {
+public:
+    /**
+     * Throws Exception if no broker is listening on socket.
+     */
+    explicit BrokerBackend(const fs::path& socket = broker::defaultSocket());
+    virtual ~BrokerBackend();
+
+    void addWatch(fs::path path, CallbackWrapper callback) override;
+
+    /**
+     * Connects to the broker at socket, or returns PathWatcher::nativeBackend() if there is none.
+     */
+    static std::unique_ptr<PathWatcher::PIMPL> connectOrNative(
+        const fs::path& socket = broker::defaultSocket());
+
+private:
+    std::string request(const std::string& line);
+    bool brokerGone() const;
+    void failOver();
+
+    int fd_ = -1;
+    broker::Ring* ring_ = nullptr;
+    size_t ringSize_ = 0;
+    std::string pending_;
+
+    std::recursive_mutex mutex_;  // Guards the socket, callbacks_, paths_ and fallback_
+    // deque, callbacks may add watches while invoked
+    std::unordered_map<uint32_t, std::deque<CallbackWrapper>> callbacks_;
+    std::unordered_map<uint32_t, fs::path> paths_;
+    std::unique_ptr<PathWatcher::PIMPL> fallback_;  // set once the broker went away
+
+    std::atomic<bool> running_{true};
+    std::thread thread_;
+};
+
+}  // namespace pathwatch
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "pathwatch.h"
+
+#include <deque>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace pathwatch {
+
+/**
+ * In-memory backend that never touches the filesystem. Actions are injected with post() or
+ * replay() and dispatched synchronously on the calling thread, in order, to the watches they
+ * match, using the same rules as the native backends: a file watch sees actions on that path, a
+ * directory watch sees actions on its direct children and on the directory itself.
+ *
+ * Not thread safe, add watches and post actions from the same thread.
+ *
+ *     auto backend = std::make_unique<pathwatch::SimulatedBackend>();
+ *     auto& sim = *backend;
+ *     pathwatch::PathWatcher watcher(std::move(backend));
+ *     watcher.watch("/tmp", callback);
+ *     sim.post(pathwatch::actions::FileAdded{"/tmp/a.txt"});
+ */
+class PW_API SimulatedBackend : public PathWatcher::PIMPL {
+public:
+    using Action = PathWatcher::Action;
+
+    SimulatedBackend() = default;
+    virtual ~SimulatedBackend() = default;
+
+    void addWatch(fs::path path, CallbackWrapper callback) override;
+
+    void post(const Action& action);
+    void replay(const std::vector<Action>& actions);
+
+    /**
+     * Reads actions written by writeTrace from the stream and posts them. Returns the number of
+     * actions replayed.
+     */
+    size_t replay(std::istream& trace);
+
+    size_t numberOfWatches() const { return callbacks_.size(); }
+
+private:
+    template <typename A>
+    void dispatch(const fs::path& path, const A& action);
+
+    std::deque<CallbackWrapper> callbacks_;  // deque, callbacks may add watches while invoked
+    // Watched path (file or directory) to indices into callbacks_
+    std::unordered_map<fs::path::string_type, std::vector<size_t>> watches_;
+};
+
+/**
+ * Plain text trace format, one action per line: the action type followed by its quoted path(s),
+ * i.e. `FileRenamed "/a/old" "/a/new"`. Can be used to record the actions a real PathWatcher
+ * delivers and to replay them deterministically with SimulatedBackend.
+ */
+PW_API void writeTrace(std::ostream& os, const PathWatcher::Action& action);
+PW_API void writeTrace(std::ostream& os, const std::vector<PathWatcher::Action>& actions);
+/**
+ * Reads the next action from the trace, returns false at the end of the stream. Throws Exception
+ * on malformed lines.
+ */
+PW_API bool readTrace(std::istream& is, PathWatcher::Action& action);
+PW_API std::vector<PathWatcher::Action> readTrace(std::istream& is);
+
+}  // namespace pathwatch
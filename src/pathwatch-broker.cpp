@@ -0,0 +1,575 @@
+#include "pw_broker.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace pathwatch {
+
+namespace broker {
+
+static const uint32_t MAGIC = 0x50574252;  // "PWBR"
+static const size_t SLOT_PAYLOAD = 4096 - 24;
+
+/**
+ * One published action. seq is a per slot seqlock: odd while the broker writes the slot, 2n + 2
+ * once it holds the n:th action of the ring.
+ */
+struct Slot {
+    std::atomic<uint64_t> seq;
+    uint32_t watch;
+    uint32_t type;  // PathWatcher::Action::index()
+    uint32_t len1;
+    uint32_t len2;
+    char data[SLOT_PAYLOAD];
+};
+
+struct alignas(64) Ring {
+    uint32_t magic;
+    uint32_t capacity;
+    std::atomic<uint64_t> head;     // number of actions published
+    std::atomic<uint32_t> futex;    // bumped and woken on every publish
+
+    Slot &slot(uint64_t n) {
+        return reinterpret_cast<Slot *>(reinterpret_cast<char *>(this) + sizeof(Ring))[n % capacity];
+    }
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Ring requires lock free atomics");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "Ring requires lock free atomics");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bit");
+
+fs::path defaultSocket() {
+    return fs::temp_directory_path() / ("pathwatch-" + std::to_string(getuid()) + ".sock");
+}
+
+}  // namespace broker
+
+namespace {
+
+size_t ringSize(size_t capacity) { return sizeof(broker::Ring) + capacity * sizeof(broker::Slot); }
+
+void futexWait(std::atomic<uint32_t> *word, uint32_t expected, long timeoutMs) {
+    struct timespec ts = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+void futexWake(std::atomic<uint32_t> *word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+            0);
+}
+
+sockaddr_un socketAddress(const fs::path &socket) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket.native().size() >= sizeof(addr.sun_path)) {
+        throw Exception("Broker socket path too long: " + socket.string());
+    }
+    std::strcpy(addr.sun_path, socket.c_str());
+    return addr;
+}
+
+int connectTo(const fs::path &socket) {
+    auto addr = socketAddress(socket);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool sendAll(int fd, const std::string &msg) {
+    size_t sent = 0;
+    while (sent < msg.size()) {
+        auto n = send(fd, msg.data() + sent, msg.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Pops the first complete line from buffer
+bool popLine(std::string &buffer, std::string &line) {
+    auto pos = buffer.find('\n');
+    if (pos == std::string::npos) return false;
+    line = buffer.substr(0, pos);
+    buffer.erase(0, pos + 1);
+    return true;
+}
+
+// Sends msg with fd attached as SCM_RIGHTS
+bool sendWithFd(int fd, const std::string &msg, int passed) {
+    iovec iov{const_cast<char *>(msg.data()), msg.size()};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr hdr{};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    auto cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &passed, sizeof(int));
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &hdr, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == static_cast<ssize_t>(msg.size());
+}
+
+// Receives into buffer, returns the fd attached as SCM_RIGHTS or -1
+int receiveFd(int fd, std::string &buffer) {
+    char buf[512];
+    iovec iov{buf, sizeof(buf)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr hdr{};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return -1;
+    buffer.append(buf, n);
+
+    int passed = -1;
+    for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return passed;
+}
+
+bool readLine(int fd, std::string &buffer, std::string &line) {
+    char buf[512];
+    while (!popLine(buffer, line)) {
+        auto n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer.append(buf, n);
+    }
+    return true;
+}
+
+std::string quote(const std::string &str) {
+    std::ostringstream ss;
+    ss << std::quoted(str);
+    return ss.str();
+}
+
+}  // namespace
+
+Broker::Broker(fs::path socket, size_t capacity)
+    : socket_(std::move(socket)), capacity_(capacity) {
+    if (capacity_ == 0 || capacity_ > UINT32_MAX) {
+        throw Exception("Invalid broker capacity");
+    }
+
+    auto addr = socketAddress(socket_);
+    int existing = connectTo(socket_);
+    if (existing != -1) {
+        close(existing);
+        throw Exception("A PathWatch broker is already listening on " + socket_.string());
+    }
+
+    // Anonymous, so brokers on different sockets never share a ring. Clients get the fd over
+    // the socket and can only map it read-only once it is sealed.
+    shmFd_ = memfd_create("pathwatch-broker", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shmFd_ == -1) {
+        throw Exception("Could not create broker shared memory");
+    }
+    ringSize_ = ringSize(capacity_);
+    void *mem = ftruncate(shmFd_, ringSize_) == -1
+                    ? MAP_FAILED
+                    : mmap(nullptr, ringSize_, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd_, 0);
+    if (mem == MAP_FAILED) {
+        close(shmFd_);
+        throw Exception("Could not map broker shared memory");
+    }
+    ring_ = new (mem) broker::Ring{};
+    ring_->capacity = static_cast<uint32_t>(capacity_);
+    for (size_t i = 0; i < capacity_; ++i) {
+        new (&ring_->slot(i)) broker::Slot{};
+    }
+    ring_->magic = broker::MAGIC;
+#ifdef F_SEAL_FUTURE_WRITE
+    fcntl(shmFd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE);
+#else
+    fcntl(shmFd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+#endif
+
+    auto fail = [&](const std::string &msg) {
+        if (listenFd_ != -1) close(listenFd_);
+        for (auto fd : stopPipe_) {
+            if (fd != -1) close(fd);
+        }
+        munmap(ring_, ringSize_);
+        close(shmFd_);
+        throw Exception(msg);
+    };
+
+    unlink(socket_.c_str());
+    listenFd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd_ == -1 || bind(listenFd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 ||
+        listen(listenFd_, SOMAXCONN) == -1) {
+        fail("Could not listen on " + socket_.string());
+    }
+    if (pipe(stopPipe_) == -1) {
+        fail("Could not start broker");
+    }
+
+    try {
+        watcher_ = std::make_unique<PathWatcher>(PathWatcher::nativeBackend());
+    } catch (const Exception &e) {
+        unlink(socket_.c_str());
+        fail(e.what());
+    }
+
+    thread_ = std::thread([&]() { loop(); });
+}
+
+Broker::~Broker() {
+    char stop = 1;
+    while (write(stopPipe_[1], &stop, 1) == -1 && errno == EINTR) {
+    }
+    thread_.join();
+    watcher_.reset();  // no more publishes after this
+
+    close(listenFd_);
+    close(stopPipe_[0]);
+    close(stopPipe_[1]);
+    unlink(socket_.c_str());
+    munmap(ring_, ringSize_);
+    close(shmFd_);
+}
+
+size_t Broker::numberOfWatches() const {
+    std::lock_guard<std::mutex> lock(watchMutex_);
+    return watchIds_.size();
+}
+
+void Broker::loop() {
+    struct Client {
+        int fd;
+        std::string buffer;
+    };
+    std::vector<Client> clients;
+    const std::string hello = "HELLO " + std::to_string(capacity_) + "\n";
+
+    while (true) {
+        std::vector<pollfd> fds;
+        fds.push_back({stopPipe_[0], POLLIN, 0});
+        fds.push_back({listenFd_, POLLIN, 0});
+        for (auto &c : clients) {
+            fds.push_back({c.fd, POLLIN, 0});
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno != EINTR) perror("poll");
+            continue;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+
+        for (size_t i = clients.size(); i-- > 0;) {
+            if (!fds[i + 2].revents) continue;
+            auto &c = clients[i];
+            char buf[4096];
+            auto n = recv(c.fd, buf, sizeof(buf), 0);
+            bool ok = n > 0 || (n < 0 && errno == EINTR);
+            if (n > 0) {
+                c.buffer.append(buf, n);
+                std::string line;
+                while (ok && popLine(c.buffer, line)) {
+                    ok = sendAll(c.fd, handle(line));
+                }
+            }
+            if (!ok) {
+                close(c.fd);
+                clients.erase(clients.begin() + i);
+            }
+        }
+
+        if (fds[1].revents) {
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd != -1) {
+                if (sendWithFd(fd, hello, shmFd_)) {
+                    clients.push_back({fd, {}});
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    for (auto &c : clients) {
+        close(c.fd);
+    }
+}
+
+std::string Broker::handle(const std::string &line) {
+    std::istringstream ss(line);
+    std::string cmd, path;
+    ss >> cmd >> std::quoted(path);
+    if (ss.fail() || cmd != "WATCH") {
+        return "ERR " + quote("Unknown request: " + line) + "\n";
+    }
+
+    std::lock_guard<std::mutex> lock(watchMutex_);
+    auto it = watchIds_.find(path);
+    if (it != watchIds_.end()) {
+        return "OK " + std::to_string(it->second) + "\n";
+    }
+
+    auto id = static_cast<uint32_t>(watchIds_.size() + 1);
+    try {
+        watcher_->watch(path, [this, id](auto action) { publish(id, std::move(action)); });
+    } catch (const Exception &e) {
+        return "ERR " + quote(e.what()) + "\n";
+    }
+    watchIds_.emplace(path, id);
+    return "OK " + std::to_string(id) + "\n";
+}
+
+void Broker::publish(uint32_t id, const PathWatcher::Action &action) {
+    const fs::path::string_type *first = nullptr;
+    const fs::path::string_type *second = nullptr;
+    std::visit(
+        [&](const auto &a) {
+            using A = std::decay_t<decltype(a)>;
+            if constexpr (std::is_same_v<A, actions::FileRenamed>) {
+                first = &a.oldPath.native();
+                second = &a.newPath.native();
+            } else {
+                first = &a.path.native();
+            }
+        },
+        action);
+    size_t len1 = first->size();
+    size_t len2 = second ? second->size() : 0;
+    if (len1 + len2 > broker::SLOT_PAYLOAD) {
+        std::cerr << "PathWatch broker: path too long, dropping action for " << *first
+                  << std::endl;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(publishMutex_);
+    auto n = ring_->head.load(std::memory_order_relaxed);
+    auto &slot = ring_->slot(n);
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.watch = id;
+    slot.type = static_cast<uint32_t>(action.index());
+    slot.len1 = static_cast<uint32_t>(len1);
+    slot.len2 = static_cast<uint32_t>(len2);
+    std::memcpy(slot.data, first->data(), len1);
+    if (second) std::memcpy(slot.data + len1, second->data(), len2);
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+
+    ring_->head.store(n + 1, std::memory_order_release);
+    ring_->futex.fetch_add(1, std::memory_order_release);
+    futexWake(&ring_->futex);
+}
+
+BrokerBackend::BrokerBackend(const fs::path &socket) : fd_(connectTo(socket)) {
+    if (fd_ == -1) {
+        throw Exception("No PathWatch broker listening on " + socket.string());
+    }
+
+    std::string line, cmd;
+    size_t capacity = 0;
+    int shm = receiveFd(fd_, pending_);
+    if (readLine(fd_, pending_, line)) {
+        std::istringstream ss(line);
+        ss >> cmd >> capacity;
+    }
+    if (cmd != "HELLO" || capacity == 0 || shm == -1) {
+        if (shm != -1) close(shm);
+        close(fd_);
+        throw Exception("Unexpected greeting from PathWatch broker: " + line);
+    }
+
+    ringSize_ = ringSize(capacity);
+    struct stat sb;
+    void *mem = fstat(shm, &sb) == -1 || static_cast<size_t>(sb.st_size) < ringSize_
+                    ? MAP_FAILED
+                    : mmap(nullptr, ringSize_, PROT_READ, MAP_SHARED, shm, 0);
+    close(shm);
+    if (mem == MAP_FAILED) {
+        close(fd_);
+        throw Exception("Could not map PathWatch broker shared memory");
+    }
+    ring_ = static_cast<broker::Ring *>(mem);
+    if (ring_->magic != broker::MAGIC || ring_->capacity != capacity) {
+        munmap(ring_, ringSize_);
+        close(fd_);
+        throw Exception("Incompatible PathWatch broker shared memory");
+    }
+
+    thread_ = std::thread([this, next = ring_->head.load(std::memory_order_acquire)]() mutable {
+        while (running_) {
+            auto seen = ring_->futex.load(std::memory_order_acquire);
+            auto head = ring_->head.load(std::memory_order_acquire);
+            std::string data;
+            while (next < head && running_) {
+                if (head - next > ring_->capacity) {
+                    std::cerr << "PathWatch broker client fell behind, lost "
+                              << head - next - ring_->capacity << " actions" << std::endl;
+                    next = head - ring_->capacity;
+                }
+
+                auto &slot = ring_->slot(next);
+                auto seq = slot.seq.load(std::memory_order_acquire);
+                uint32_t watch = slot.watch;
+                uint32_t type = slot.type;
+                size_t len1 = std::min<size_t>(slot.len1, broker::SLOT_PAYLOAD);
+                size_t len2 = std::min<size_t>(slot.len2, broker::SLOT_PAYLOAD - len1);
+                data.assign(slot.data, len1 + len2);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (seq != 2 * next + 2 || slot.seq.load(std::memory_order_relaxed) != seq) {
+                    // Overwritten while reading, skip ahead
+                    head = ring_->head.load(std::memory_order_acquire);
+                    next = std::max(next + 1, head - std::min<uint64_t>(head, ring_->capacity));
+                    continue;
+                }
+                ++next;
+
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                auto it = callbacks_.find(watch);
+                if (it == callbacks_.end()) continue;
+                auto &callbacks = it->second;
+                auto invoke = [&](auto action) {
+                    // by index, a callback may add another watch of the same path
+                    for (size_t c = 0; c < callbacks.size(); ++c) callbacks[c](action);
+                };
+                fs::path path1(data.substr(0, len1));
+                switch (type) {
+                    case 0:
+                        invoke(actions::FileAdded{path1});
+                        break;
+                    case 1:
+                        invoke(actions::FileRemoved{path1});
+                        break;
+                    case 2:
+                        invoke(actions::FileModified{path1});
+                        break;
+                    case 3:
+                        invoke(actions::FileRenamed{path1, data.substr(len1)});
+                        break;
+                    default:
+                        break;
+                }
+            }
+            if (running_ && brokerGone()) {
+                if (next == ring_->head.load(std::memory_order_acquire)) {
+                    failOver();
+                    return;
+                }
+                continue;  // deliver what the broker published before it went away
+            }
+            if (running_) {
+                futexWait(&ring_->futex, seen, 100);
+            }
+        }
+    });
+}
+
+bool BrokerBackend::brokerGone() const {
+    pollfd pfd{fd_, POLLRDHUP, 0};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+void BrokerBackend::failOver() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    std::cerr << "PathWatch broker went away, falling back to local watches" << std::endl;
+    try {
+        fallback_ = PathWatcher::nativeBackend();
+    } catch (const Exception &e) {
+        std::cerr << "PathWatch fallback failed: " << e.what() << std::endl;
+        return;
+    }
+    for (auto &item : callbacks_) {
+        for (auto &cb : item.second) {
+            try {
+                fallback_->addWatch(paths_.at(item.first), std::move(cb));
+            } catch (const Exception &) {
+                // Path is gone, nothing left to watch
+            }
+        }
+    }
+    callbacks_.clear();
+}
+
+BrokerBackend::~BrokerBackend() {
+    running_ = false;
+    thread_.join();
+    munmap(ring_, ringSize_);
+    close(fd_);
+}
+
+void BrokerBackend::addWatch(fs::path path, CallbackWrapper callback) {
+    path = fs::absolute(path).lexically_normal();
+    if (!path.has_filename() && path != path.root_path()) {
+        path = path.parent_path();  // drop trailing separator
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    if (fallback_) {
+        return fallback_->addWatch(path, std::move(callback));
+    }
+    auto reply = request("WATCH " + quote(path.string()) + "\n");
+
+    std::istringstream ss(reply);
+    std::string status;
+    ss >> status;
+    if (status == "OK") {
+        uint32_t id = 0;
+        ss >> id;
+        paths_[id] = path;
+        callbacks_[id].push_back(std::move(callback));
+    } else {
+        std::string msg;
+        ss >> std::quoted(msg);
+        throw Exception(msg.empty() ? "PathWatch broker refused watch" : msg);
+    }
+}
+
+std::string BrokerBackend::request(const std::string &line) {
+    std::string reply;
+    if (!sendAll(fd_, line) || !readLine(fd_, pending_, reply)) {
+        throw Exception("Lost connection to PathWatch broker");
+    }
+    return reply;
+}
+
+std::unique_ptr<PathWatcher::PIMPL> BrokerBackend::connectOrNative(const fs::path &socket) {
+    try {
+        return std::make_unique<BrokerBackend>(socket);
+    } catch (const Exception &) {
+        return PathWatcher::nativeBackend();
+    }
+}
+
+}  // namespace pathwatch
@@ -1,21 +1,21 @@
-
 #include "pathwatch.h"
 
 
 namespace pathwatch {
 
-
-PathWatcher::PathWatcher()  {
-
-    
-
-
+class PathWatcherFallbackInternals : public PathWatcher::PIMPL {
+public:
+    void addWatch(fs::path path, CallbackWrapper) override {
+        if (!fs::is_regular_file(path) && !fs::is_directory(path)) {
+            throw Exception("Given path is not a file nor a directory");
+        }
+    }
+};
+
+std::unique_ptr<PathWatcher::PIMPL> PathWatcher::nativeBackend() {
+    return std::make_unique<PathWatcherFallbackInternals>();
 }
 
-void PathWatcher::watchInternal(fs::path, CallbackWrapper callbacks) {
+PathWatcher::PathWatcher() : impl_(nativeBackend()) {}
 
 }
-
-PathWatcher::~PathWatcher() {}
-
-}
\ No newline at end of file
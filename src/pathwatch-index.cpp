@@ -0,0 +1,286 @@
+#include "pathwatch.h"
+
+#include <mutex>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace pathwatch {
+
+/**
+ * Per directory aggregates, rolled up to every indexed ancestor on each change. bytes and files
+ * are plain deltas, newest is the max of a multiset holding the mtimes of the directory's own
+ * files and the newest of each subdirectory, so removals stay exact without rescanning.
+ */
+class DirectoryIndex {
+public:
+    using Key = fs::path::string_type;
+    using Time = fs::file_time_type;
+
+    /**
+     * A directory that needs a watch. Only the callback registered with the current token of a
+     * directory updates the index: a moved directory keeps its kernel watch and old callback,
+     * and backends never drop the callbacks of paths that are gone.
+     */
+    struct NewWatch {
+        fs::path dir;
+        uint64_t token;
+    };
+
+    /**
+     * Adds root and everything below it, returns the directories that need a watch.
+     */
+    std::vector<NewWatch> add(const fs::path &root) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<NewWatch> newDirs;
+        auto path = normalize(root);
+        if (dirs_.count(path.native()) == 0) {
+            auto parent = path.parent_path();
+            scan(path, dirs_.count(parent.native()) ? parent.native() : Key{}, newDirs);
+        }
+        return newDirs;
+    }
+
+    /**
+     * Updates the index from an action of the watch on dir, returns new directories that need a
+     * watch. Ignored unless token is still the current one of dir.
+     */
+    std::vector<NewWatch> apply(const Key &dir, uint64_t token, const PathWatcher::Action &action) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<NewWatch> newDirs;
+        auto it = dirs_.find(dir);
+        if (it == dirs_.end() || it->second.token != token) return newDirs;
+        std::visit(
+            [&](const auto &a) {
+                using A = std::decay_t<decltype(a)>;
+                if constexpr (std::is_same_v<A, actions::FileRenamed>) {
+                    forget(normalize(a.oldPath).native());
+                    refresh(normalize(a.newPath), newDirs);
+                } else if constexpr (std::is_same_v<A, actions::FileRemoved>) {
+                    forget(normalize(a.path).native());
+                } else {
+                    refresh(normalize(a.path), newDirs);
+                }
+            },
+            action);
+        return newDirs;
+    }
+
+    std::optional<DirectoryAggregate> find(const fs::path &dir) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = dirs_.find(normalize(dir).native());
+        if (it == dirs_.end()) return std::nullopt;
+        return it->second.total;
+    }
+
+private:
+    struct Directory {
+        Key parent;  // empty for an index root
+        uint64_t token;  // of the callback that updates the index
+        DirectoryAggregate total;
+        std::multiset<Time> times;  // own files and the newest of each subdirectory
+        std::unordered_set<Key> files;
+        std::unordered_set<Key> children;
+    };
+    struct File {
+        Key dir;
+        std::uintmax_t size;
+        Time mtime;
+    };
+
+    static fs::path normalize(const fs::path &path) {
+        auto p = path.lexically_normal();
+        if (!p.has_filename() && p != p.root_path()) {
+            p = p.parent_path();  // drop trailing separator
+        }
+        return p;
+    }
+
+    static std::optional<Time> contributes(Time t) {
+        return t == Time::min() ? std::nullopt : std::optional<Time>{t};
+    }
+
+    // Applies a change in dir to dir and all its indexed ancestors
+    void propagate(Key dir, std::intmax_t bytes, std::intmax_t files, std::optional<Time> removed,
+                   std::optional<Time> added) {
+        while (!dir.empty()) {
+            auto &d = dirs_.at(dir);
+            d.total.bytes += static_cast<std::uintmax_t>(bytes);
+            d.total.files += static_cast<std::uintmax_t>(files);
+            if (removed || added) {
+                auto before = d.total.newest;
+                if (removed) d.times.erase(d.times.find(*removed));
+                if (added) d.times.insert(*added);
+                d.total.newest = d.times.empty() ? Time::min() : *d.times.rbegin();
+                if (d.total.newest == before) {
+                    removed.reset();
+                    added.reset();
+                } else {
+                    removed = contributes(before);
+                    added = contributes(d.total.newest);
+                }
+            }
+            dir = d.parent;
+        }
+    }
+
+    void addDirectory(const Key &dir, const Key &parent, std::vector<NewWatch> &newDirs) {
+        auto &d = dirs_[dir];
+        d.parent = parent;
+        d.token = nextToken_++;
+        if (!parent.empty()) dirs_.at(parent).children.insert(dir);
+        newDirs.push_back({dir, d.token});
+    }
+
+    // Links an existing index root below parent
+    void attach(const Key &dir, const Key &parent) {
+        auto &d = dirs_.at(dir);
+        d.parent = parent;
+        dirs_.at(parent).children.insert(dir);
+        propagate(parent, d.total.bytes, d.total.files, std::nullopt, contributes(d.total.newest));
+    }
+
+    void addFile(const Key &dir, const Key &file, std::uintmax_t size, Time mtime) {
+        auto it = files_.find(file);
+        if (it != files_.end()) {
+            auto &f = it->second;
+            auto delta = static_cast<std::intmax_t>(size - f.size);
+            auto old = f.mtime;
+            f.size = size;
+            f.mtime = mtime;
+            propagate(dir, delta, 0, old, mtime);
+        } else {
+            files_.emplace(file, File{dir, size, mtime});
+            dirs_.at(dir).files.insert(file);
+            propagate(dir, static_cast<std::intmax_t>(size), 1, std::nullopt, mtime);
+        }
+    }
+
+    void removeFile(const Key &file) {
+        auto it = files_.find(file);
+        auto f = it->second;
+        files_.erase(it);
+        dirs_.at(f.dir).files.erase(file);
+        propagate(f.dir, -static_cast<std::intmax_t>(f.size), -1, f.mtime, std::nullopt);
+    }
+
+    void removeDirectory(const Key &dir) {
+        auto &d = dirs_.at(dir);
+        if (!d.parent.empty()) {
+            dirs_.at(d.parent).children.erase(dir);
+            propagate(d.parent, -static_cast<std::intmax_t>(d.total.bytes),
+                      -static_cast<std::intmax_t>(d.total.files), contributes(d.total.newest),
+                      std::nullopt);
+        }
+
+        std::vector<Key> stack{dir};
+        while (!stack.empty()) {
+            auto it = dirs_.find(stack.back());
+            stack.pop_back();
+            for (auto &file : it->second.files) files_.erase(file);
+            stack.insert(stack.end(), it->second.children.begin(), it->second.children.end());
+            dirs_.erase(it);
+        }
+    }
+
+    void forget(const Key &key) {
+        if (files_.count(key)) {
+            removeFile(key);
+        } else if (dirs_.count(key)) {
+            removeDirectory(key);
+        }
+    }
+
+    void scan(const fs::path &root, const Key &parent, std::vector<NewWatch> &newDirs) {
+        addDirectory(root.native(), parent, newDirs);
+
+        std::error_code ec;
+        fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied,
+                                            ec);
+        for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+            auto &entry = *it;
+            const auto &key = entry.path().native();
+            const Key dir = entry.path().parent_path().native();
+            std::error_code err;
+            auto status = entry.symlink_status(err);
+            if (err) continue;
+
+            if (fs::is_directory(status)) {
+                if (dirs_.count(key)) {
+                    attach(key, dir);
+                    it.disable_recursion_pending();
+                } else {
+                    addDirectory(key, dir, newDirs);
+                }
+            } else if (fs::is_regular_file(status)) {
+                auto size = entry.file_size(err);
+                auto mtime = err ? Time::min() : entry.last_write_time(err);
+                if (!err) addFile(dir, key, size, mtime);
+            }
+        }
+    }
+
+    void refresh(const fs::path &path, std::vector<NewWatch> &newDirs) {
+        const auto &key = path.native();
+        const Key parent = path.parent_path().native();
+        if (!dirs_.count(parent) && !dirs_.count(key)) return;
+
+        std::error_code ec;
+        auto status = fs::symlink_status(path, ec);
+        if (fs::is_regular_file(status)) {
+            auto size = fs::file_size(path, ec);
+            auto mtime = ec ? Time::min() : fs::last_write_time(path, ec);
+            if (ec) return forget(key);
+            if (dirs_.count(key)) removeDirectory(key);
+            if (dirs_.count(parent)) addFile(parent, key, size, mtime);
+        } else if (fs::is_directory(status)) {
+            if (files_.count(key)) removeFile(key);
+            if (!dirs_.count(key)) scan(path, parent, newDirs);
+        } else {
+            forget(key);
+        }
+    }
+
+    mutable std::mutex mutex_;
+    std::unordered_map<Key, Directory> dirs_;
+    std::unordered_map<Key, File> files_;
+    uint64_t nextToken_ = 1;
+};
+
+namespace {
+// Watches dirs, with callbacks that feed the index and watch directories it discovers
+void watchIndexed(PathWatcher::PIMPL *backend, const std::shared_ptr<DirectoryIndex> &index,
+                  const std::vector<DirectoryIndex::NewWatch> &dirs) {
+    for (auto &dir : dirs) {
+        try {
+            backend->addWatch(dir.dir, [backend, index, key = dir.dir.native(),
+                                        token = dir.token](auto action) {
+                watchIndexed(backend, index, index->apply(key, token, action));
+            });
+        } catch (const Exception &) {
+            // Directory is already gone, its removal will reach the index
+        }
+    }
+}
+}  // namespace
+
+void PathWatcher::index(const fs::path &dir) {
+    if (!fs::is_directory(dir)) {
+        throw Exception("Given path is not a directory");
+    }
+    if (!index_) {
+        index_ = std::make_shared<DirectoryIndex>();
+    }
+    watchIndexed(impl_.get(), index_, index_->add(fs::absolute(dir)));
+}
+
+DirectoryAggregate PathWatcher::aggregate(const fs::path &dir) const {
+    auto result = index_ ? index_->find(fs::absolute(dir)) : std::nullopt;
+    if (!result) {
+        throw Exception("Given path is not indexed");
+    }
+    return *result;
+}
+
+}  // namespace pathwatch
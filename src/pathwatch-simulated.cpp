@@ -0,0 +1,131 @@
+#include "pw_simulated.h"
+
+#include <iomanip>
+#include <sstream>
+
+namespace pathwatch {
+
+void SimulatedBackend::addWatch(fs::path path, CallbackWrapper callback) {
+    path = path.lexically_normal();
+    if (!path.has_filename() && path != path.root_path()) {
+        path = path.parent_path();  // drop trailing separator
+    }
+    callbacks_.push_back(std::move(callback));
+    watches_[path.native()].push_back(callbacks_.size() - 1);
+}
+
+template <typename A>
+void SimulatedBackend::dispatch(const fs::path& path, const A& action) {
+    auto it = watches_.find(path.native());
+    if (it == watches_.end()) return;
+    // by index, a callback may add another watch of the same path
+    auto &ids = it->second;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        callbacks_[ids[i]](action);
+    }
+}
+
+void SimulatedBackend::post(const Action& action) {
+    std::visit(
+        [&](const auto& a) {
+            using A = std::decay_t<decltype(a)>;
+            if constexpr (std::is_same_v<A, actions::FileRenamed>) {
+                auto oldParent = a.oldPath.parent_path();
+                auto newParent = a.newPath.parent_path();
+                dispatch(a.oldPath, a);
+                dispatch(a.newPath, a);
+                dispatch(oldParent, a);
+                if (newParent != oldParent) {
+                    dispatch(newParent, a);
+                }
+            } else {
+                auto parent = a.path.parent_path();
+                dispatch(a.path, a);
+                if (parent != a.path) {
+                    dispatch(parent, a);
+                }
+            }
+        },
+        action);
+}
+
+void SimulatedBackend::replay(const std::vector<Action>& actions) {
+    for (const auto& action : actions) {
+        post(action);
+    }
+}
+
+size_t SimulatedBackend::replay(std::istream& trace) {
+    size_t count = 0;
+    Action action;
+    while (readTrace(trace, action)) {
+        post(action);
+        ++count;
+    }
+    return count;
+}
+
+void writeTrace(std::ostream& os, const PathWatcher::Action& action) {
+    std::visit(
+        [&](const auto& a) {
+            using A = std::decay_t<decltype(a)>;
+            os << A::type;
+            if constexpr (std::is_same_v<A, actions::FileRenamed>) {
+                os << " " << std::quoted(a.oldPath.string()) << " "
+                   << std::quoted(a.newPath.string());
+            } else {
+                os << " " << std::quoted(a.path.string());
+            }
+            os << "\n";
+        },
+        action);
+}
+
+void writeTrace(std::ostream& os, const std::vector<PathWatcher::Action>& actions) {
+    for (const auto& action : actions) {
+        writeTrace(os, action);
+    }
+}
+
+bool readTrace(std::istream& is, PathWatcher::Action& action) {
+    std::string line;
+    while (std::getline(is, line)) {
+        if (line.empty()) continue;
+
+        std::istringstream ss(line);
+        std::string type, first, second;
+        ss >> type >> std::quoted(first);
+        if (ss.fail()) {
+            throw Exception("Malformed trace line: " + line);
+        }
+
+        if (type == actions::FileAdded::type) {
+            action = actions::FileAdded{first};
+        } else if (type == actions::FileRemoved::type) {
+            action = actions::FileRemoved{first};
+        } else if (type == actions::FileModified::type) {
+            action = actions::FileModified{first};
+        } else if (type == actions::FileRenamed::type) {
+            ss >> std::quoted(second);
+            if (ss.fail()) {
+                throw Exception("Malformed trace line: " + line);
+            }
+            action = actions::FileRenamed{first, second};
+        } else {
+            throw Exception("Unknown action in trace: " + type);
+        }
+        return true;
+    }
+    return false;
+}
+
+std::vector<PathWatcher::Action> readTrace(std::istream& is) {
+    std::vector<PathWatcher::Action> actions;
+    PathWatcher::Action action;
+    while (readTrace(is, action)) {
+        actions.push_back(std::move(action));
+    }
+    return actions;
+}
+
+}  // namespace pathwatch
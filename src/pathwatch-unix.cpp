@@ -1,13 +1,24 @@
 
 #include "pathwatch.h"
+#include "pw_broker.h"
 
 #include <sys/inotify.h>
 #include <unistd.h>
-
+#include <poll.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
 #include <thread>
 #include <iostream>
+#include <list>
+#include <mutex>
 #include <utility>
 #include <unordered_map>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -25,6 +36,51 @@ bool operator!=(struct stat a, struct stat b) {
     return a.st_atime != b.st_atime || a.st_mtime != b.st_mtime || a.st_ctime != b.st_ctime || a.st_size != b.st_size;
 }
 
+// Polled watches with changes in this many of their last 8 polls get a kernel watch again
+static const int PROMOTE_AFTER = 2;
+
+static size_t maxUserWatches() {
+    std::ifstream in("/proc/sys/fs/inotify/max_user_watches");
+    size_t max = 0;
+    in >> max;
+    return max > 0 ? max : 8192;
+}
+
+/**
+ * State of a demoted watch: the watched path itself under "" and, for a directory, each entry
+ * by name.
+ */
+struct PollEntry {
+    mode_t mode;
+    off_t size;
+    struct timespec mtime;
+
+    bool operator!=(const PollEntry &b) const {
+        return size != b.size || mtime.tv_sec != b.mtime.tv_sec || mtime.tv_nsec != b.mtime.tv_nsec;
+    }
+};
+using Snapshot = std::unordered_map<std::string, PollEntry>;
+
+static Snapshot takeSnapshot(const fs::path &path) {
+    Snapshot snapshot;
+    struct stat sb;
+    if (stat(path.c_str(), &sb) != 0) return snapshot;
+    snapshot.emplace("", PollEntry{sb.st_mode, sb.st_size, sb.st_mtim});
+    if (!S_ISDIR(sb.st_mode)) return snapshot;
+
+    DIR *dir = opendir(path.c_str());
+    if (!dir) return snapshot;
+    while (auto entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        if (fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+            snapshot.emplace(std::move(name), PollEntry{sb.st_mode, sb.st_size, sb.st_mtim});
+        }
+    }
+    closedir(dir);
+    return snapshot;
+}
+
 class PathWatcherUnixInternals : public PathWatcher::PIMPL {
 public:
     friend class PathWatcher;
@@ -32,6 +88,11 @@ public:
         if (inotifyID == -1) {
             throw Exception("Failed to init PathWatcher");
         }
+        if (pipe2(wakePipe_, O_NONBLOCK | O_CLOEXEC) == -1) {
+            close(inotifyID);
+            throw Exception("Failed to init PathWatcher");
+        }
+        budget_ = maxUserWatches();
 
         thread_ = std::thread([&]() { loop(); });
 
@@ -48,6 +109,22 @@ public:
         std::cout << "IN_DELETE_SELF: " << IN_DELETE_SELF << std::endl;
     }
 
+    ~PathWatcherUnixInternals() {
+        running_ = false;
+        wake();
+        thread_.join();
+        close(wakePipe_[0]);
+        close(wakePipe_[1]);
+        close(inotifyID);
+    }
+
+    // Makes the loop recheck running_ and when to poll next
+    void wake() {
+        char c = 1;
+        while (write(wakePipe_[1], &c, 1) == -1 && errno == EINTR) {
+        }
+    }
+
     // struct inotify_event {
     //        __s32 wd;             /* watch descriptor */
     //        __u32 mask;           /* watch mask */
@@ -61,11 +138,44 @@ public:
         const static size_t EVENT_SIZE = sizeof(struct inotify_event);
         const static size_t BUF_LEN = 1024;
         char buf[BUF_LEN];
-        actions::FileRenamed renameAction;
+        // IN_MOVED_FROM halves by cookie, waiting for their IN_MOVED_TO within the same read
+        std::unordered_map<uint32_t, std::pair<int, fs::path>> movedFrom;
 
         std::unordered_map<std::wstring, struct stat> lastModificationTimes;
 
-        while (true) {
+        while (running_) {
+            int timeout = -1;
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                if (numberOfPolled() > 0) {
+                    auto now = std::chrono::steady_clock::now();
+                    if (now >= nextPoll_) {
+                        pollDemoted();
+                        nextPoll_ = now + pollInterval_;
+                    }
+                    timeout = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                   nextPoll_ - now)
+                                                   .count()) + 1;
+                }
+            }
+
+            struct pollfd fds[2] = {{inotifyID, POLLIN, 0}, {wakePipe_[0], POLLIN, 0}};
+            if (poll(fds, 2, timeout) < 0) {
+                if (errno != EINTR) perror("poll");
+                continue;
+            }
+            if (fds[1].revents) {
+                char drain[64];
+                ssize_t n;
+                while ((n = read(wakePipe_[0], drain, sizeof(drain))) > 0 ||
+                       (n < 0 && errno == EINTR)) {
+                }  // until EAGAIN
+                continue;
+            }
+            if (!fds[0].revents) {
+                continue;
+            }
+
             int i = 0;
             int len = read(inotifyID, buf, BUF_LEN);
 
@@ -77,6 +187,7 @@ public:
             } else if (len == 0) {
                 /* BUF_LEN too small? */
             } else {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
                 while (i < len) {
                     struct inotify_event *event;
 
@@ -95,10 +206,12 @@ public:
                     }
 
 
-                    auto it = callbacks_.find(event->wd);
-                    if (it != callbacks_.end() && event->mask <= ALL_FALGS) {
-                        CallbackWrapper &cb = it->second.first;
-                        auto path = it->second.second;
+                    auto it = watches_.find(event->wd);
+                    if (it != watches_.end() && (event->mask & ~IN_ISDIR) <= ALL_FALGS) {
+                        auto &watch = it->second;
+                        lru_.splice(lru_.begin(), lru_, watch.lru);
+                        auto cb = [&](auto action) { invoke(watch, action); };
+                        auto path = watch.path;
                         if (fs::is_directory(path) && event->len > 0) {
                             path /= event->name;
                         }
@@ -121,21 +234,35 @@ public:
                             cb(actions::FileRemoved{path});
                         }
                         if (event->mask & IN_MOVED_FROM) {
-                            renameAction.oldPath = path;
+                            movedFrom[event->cookie] = {event->wd, path};
                         }
                         if (event->mask & IN_MOVED_TO) {
-                            renameAction.newPath = path;
-                        }
-
-                        if (!renameAction.oldPath.empty() && !renameAction.newPath.empty()) {
-                            cb(renameAction);
-                            renameAction.oldPath.clear();
-                            renameAction.newPath.clear();
+                            auto from = movedFrom.find(event->cookie);
+                            if (from == movedFrom.end()) {
+                                cb(actions::FileAdded{path});  // moved in from outside
+                            } else {
+                                actions::FileRenamed rename{from->second.second, path};
+                                auto source = watches_.find(from->second.first);
+                                movedFrom.erase(from);
+                                cb(rename);
+                                if (source != watches_.end() && &source->second != &watch) {
+                                    invoke(source->second, rename);
+                                }
+                            }
                         }
                     }
 
                     i += EVENT_SIZE + event->len;
                 }
+
+                // Moved out of everything watched, or the other half did not fit in this read
+                for (auto &from : movedFrom) {
+                    auto it = watches_.find(from.second.first);
+                    if (it != watches_.end()) {
+                        invoke(it->second, actions::FileRemoved{from.second.second});
+                    }
+                }
+                movedFrom.clear();
             }
         }
     }
@@ -154,35 +281,207 @@ public:
      *
      */
 
-    void addWatch(fs::path path, CallbackWrapper callback) {
-        auto id = inotify_add_watch(inotifyID, path.c_str(), IN_ALL_EVENTS);
+    void addWatch(fs::path path, CallbackWrapper callback) override {
+        if (!fs::is_regular_file(path) && !fs::is_directory(path)) {
+            throw Exception("Given path is not a file nor a directory");
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        auto existing = ids_.find(path.native());
+        if (existing != ids_.end()) {
+            watches_.at(existing->second).callbacks.push_back(std::move(callback));
+            return;
+        }
+
+        int id = -1;
+        if (lru_.size() < budget_) {
+            id = inotify_add_watch(inotifyID, path.c_str(), IN_ALL_EVENTS);
+            if (id < 0 && errno == ENOSPC) {
+                budget_ = lru_.size();  // the per user limit is shared with other watchers
+            } else if (id < 0) {
+                throw Exception("Could not add watch");
+            }
+        }
+
         if (id < 0) {
-            throw Exception("Could not add watch");
+            auto &watch = watches_[nextPolledId_--];
+            watch.path = path;
+            watch.callbacks.push_back(std::move(callback));
+            watch.snapshot = takeSnapshot(path);
+            ids_[path.native()] = nextPolledId_ + 1;
+            if (numberOfPolled() == 1) {
+                nextPoll_ = std::chrono::steady_clock::now() + pollInterval_;
+                wake();
+            }
+            return;
+        }
+
+        auto &watch = watches_[id];
+        if (watch.callbacks.empty()) {
+            watch.lru = lru_.insert(lru_.begin(), id);
+        } else {
+            ids_.erase(watch.path.native());  // a watched directory that has been moved
+        }
+        watch.path = path;
+        watch.callbacks.push_back(std::move(callback));
+        ids_[path.native()] = id;
+    }
+
+    void setWatchBudget(size_t budget, std::chrono::milliseconds pollInterval) override {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        auto max = maxUserWatches();
+        budget_ = budget == 0 ? max : std::min(budget, max);
+        pollInterval_ = pollInterval;
+        while (lru_.size() > budget_) {
+            demote(lru_.back());
+        }
+        std::vector<int> polled;
+        for (auto &item : watches_) {
+            if (item.first < 0) polled.push_back(item.first);
+        }
+        for (size_t i = 0; i < polled.size() && lru_.size() < budget_; ++i) {
+            promote(polled[i]);
         }
+        nextPoll_ = std::min(nextPoll_, std::chrono::steady_clock::now() + pollInterval_);
+        wake();
+    }
 
-        callbacks_.emplace(id, std::make_pair(callback, path));
+private:
+    struct Watch {
+        fs::path path;
+        std::deque<CallbackWrapper> callbacks;  // deque, callbacks may add watches while invoked
+        std::list<int>::iterator lru;  // position in lru_, kernel watches only
+        Snapshot snapshot;             // polled watches only
+        uint8_t recentPolls = 0;       // one bit per recent poll, set if it saw changes
+    };
+
+    template <typename Action>
+    void invoke(Watch &watch, const Action &action) {
+        // by index, a callback may add another watch of the same path
+        for (size_t c = 0; c < watch.callbacks.size(); ++c) watch.callbacks[c](action);
     }
 
-    std::unordered_map<int, std::pair<CallbackWrapper, fs::path> > callbacks_;
+    size_t numberOfPolled() const { return watches_.size() - lru_.size(); }
+
+    // Moves the watch stored under from to key to, keeping the Watch in place
+    void rekey(int from, int to) {
+        auto node = watches_.extract(from);
+        node.key() = to;
+        ids_[node.mapped().path.native()] = to;
+        watches_.insert(std::move(node));
+    }
+
+    void demote(int wd) {
+        auto &watch = watches_.at(wd);
+        inotify_rm_watch(inotifyID, wd);
+        lru_.erase(watch.lru);
+        watch.snapshot = takeSnapshot(watch.path);
+        watch.recentPolls = 0;
+        rekey(wd, nextPolledId_--);
+    }
+
+    void promote(int id) {
+        if (lru_.size() >= budget_) {
+            if (lru_.empty()) return;
+            demote(lru_.back());
+        }
+        auto &watch = watches_.at(id);
+        int wd = inotify_add_watch(inotifyID, watch.path.c_str(), IN_ALL_EVENTS);
+        if (wd < 0) {
+            if (errno == ENOSPC) budget_ = lru_.size();
+            watch.recentPolls = 0;
+            return;
+        }
+
+        auto alias = watches_.find(wd);
+        if (alias != watches_.end()) {  // same inode already watched under another path
+            for (auto &cb : watch.callbacks) alias->second.callbacks.push_back(std::move(cb));
+            ids_[watch.path.native()] = wd;
+            watches_.erase(id);
+            return;
+        }
+        watch.snapshot.clear();
+        watch.lru = lru_.insert(lru_.begin(), wd);
+        rekey(id, wd);
+    }
 
+    // Stats every demoted watch and reports the differences since the last poll
+    void pollDemoted() {
+        std::vector<int> polled;
+        for (auto &item : watches_) {
+            if (item.first < 0) polled.push_back(item.first);
+        }
+
+        for (auto id : polled) {
+            auto it = watches_.find(id);
+            if (it == watches_.end()) continue;
+            auto &watch = it->second;
+            auto snapshot = takeSnapshot(watch.path);
+            auto before = std::move(watch.snapshot);
+            watch.snapshot = snapshot;
+
+            bool changed = false;
+            for (auto &entry : snapshot) {
+                auto old = before.find(entry.first);
+                if (entry.first.empty()) {
+                    if (old != before.end() && !S_ISDIR(entry.second.mode) &&
+                        old->second != entry.second) {
+                        changed = true;
+                        invoke(watch, actions::FileModified{watch.path});
+                    }
+                } else if (old == before.end()) {
+                    changed = true;
+                    invoke(watch, actions::FileAdded{watch.path / entry.first});
+                } else if (old->second != entry.second) {
+                    changed = true;
+                    invoke(watch, actions::FileModified{watch.path / entry.first});
+                }
+            }
+            for (auto &entry : before) {
+                if (snapshot.count(entry.first)) continue;
+                changed = true;
+                invoke(watch, actions::FileRemoved{entry.first.empty() ? watch.path
+                                                                       : watch.path / entry.first});
+            }
+
+            watch.recentPolls = static_cast<uint8_t>(watch.recentPolls << 1 | changed);
+            if (__builtin_popcount(watch.recentPolls) >= PROMOTE_AFTER) {
+                promote(id);
+            }
+        }
+    }
+
+    // Guards everything below, recursive since callbacks may add new watches
+    std::recursive_mutex mutex_;
+    // Kernel watches by watch descriptor, polled watches by negative ids
+    std::unordered_map<int, Watch> watches_;
+    std::unordered_map<fs::path::string_type, int> ids_;
+    std::list<int> lru_;  // kernel watches, most recently active first
+    int nextPolledId_ = -1;
+    size_t budget_ = 0;
+    std::chrono::milliseconds pollInterval_ = std::chrono::seconds(2);
+    std::chrono::steady_clock::time_point nextPoll_;
+
+    std::atomic<bool> running_{true};
     std::thread thread_;
     int inotifyID;
+    int wakePipe_[2];
 };
 
-namespace {
-PathWatcherUnixInternals &impl(PathWatcher *wathcer) {
-    return *static_cast<PathWatcherUnixInternals *>(wathcer->impl_.get());
+std::unique_ptr<PathWatcher::PIMPL> PathWatcher::nativeBackend() {
+    return std::make_unique<PathWatcherUnixInternals>();
 }
-}  // namespace
-
-#define IMPL impl(this)
 
-PathWatcher::PathWatcher() : impl_(std::make_unique<PathWatcherUnixInternals>()) {}
-
-void PathWatcher::watchInternal(fs::path path, CallbackWrapper callback) {
-    IMPL.addWatch(path, callback);
+namespace {
+std::unique_ptr<PathWatcher::PIMPL> defaultBackend() {
+    auto socket = std::getenv("PATHWATCH_BROKER");
+    if (socket && *socket) {
+        return BrokerBackend::connectOrNative(socket);
+    }
+    return PathWatcher::nativeBackend();
 }
+}  // namespace
 
-PathWatcher::~PathWatcher() {}
+PathWatcher::PathWatcher() : impl_(defaultBackend()) {}
 
 }  // namespace pathwatch
\ No newline at end of file
@@ -44,7 +44,7 @@ public:
     friend class PathWatcher;
     PathWatcherWinInternals();
     ~PathWatcherWinInternals();
-    void addWatch(fs::path path, CallbackWrapper callback);
+    void addWatch(fs::path path, CallbackWrapper callback) override;
 
 private:
     void loop();
@@ -62,17 +62,6 @@ private:
     std::thread thread_;  // init thread last
 };
 
-namespace {
-PathWatcherWinInternals &impl(PathWatcher *wathcer) {
-    return *static_cast<PathWatcherWinInternals *>(wathcer->impl_.get());
-}
-}  // namespace
-
-#define IMPL impl(this)
-
-
-
-
 namespace winutil {
 
 void printError() {
@@ -235,21 +224,19 @@ void PathWatcherWinInternals::loop() {
 }
 
 void PathWatcherWinInternals::addWatch(fs::path path, CallbackWrapper callback) {
-    newWatches_.emplace_back(path, callback);
-    SetEvent(newWatchEvent_);
-}
-
-PathWatcher::PathWatcher() : impl_(std::make_unique<PathWatcherWinInternals>()) {}
-
- void PathWatcher::watchInternal(fs::path path, CallbackWrapper callback) {
     bool isFile = fs::is_regular_file(path);
     bool isDir = fs::is_directory(path);
     if (!isFile && !isDir) {
         throw Exception("Given path is not a file nor a directory");
     }
-    IMPL.addWatch(path, callback);
+    newWatches_.emplace_back(path, callback);
+    SetEvent(newWatchEvent_);
+}
+
+std::unique_ptr<PathWatcher::PIMPL> PathWatcher::nativeBackend() {
+    return std::make_unique<PathWatcherWinInternals>();
 }
 
-PathWatcher::~PathWatcher() {}
+PathWatcher::PathWatcher() : impl_(nativeBackend()) {}
 
 }  // namespace pathwatch
\ No newline at end of file
@@ -7,4 +7,21 @@ const char *FileRemoved::type = "FileRemoved";
 const char *FileModified::type = "FileModified";
 const char *FileRenamed::type = "FileRenamed";
 }  // namespace actions
+
+PathWatcher::PathWatcher(std::unique_ptr<PIMPL> backend) : impl_(std::move(backend)) {
+    if (!impl_) {
+        throw Exception("PathWatcher requires a backend");
+    }
+}
+
+void PathWatcher::watchInternal(fs::path path, CallbackWrapper callback) {
+    impl_->addWatch(std::move(path), std::move(callback));
+}
+
+void PathWatcher::setWatchBudget(size_t budget, std::chrono::milliseconds pollInterval) {
+    impl_->setWatchBudget(budget, pollInterval);
+}
+
+PathWatcher::~PathWatcher() {}
+
 }  // namespace pathwatch
\ No newline at end of file
@@ -0,0 +1,102 @@
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#include "catch2/catch.hpp"
+
+#include <pathwatch.h>
+
+#ifdef __linux__
+#include <pw_broker.h>
+
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace local {
+struct TmpDir {
+    TmpDir() {
+        std::random_device rd;
+        path = std::filesystem::temp_directory_path() / "pathwatch-testing" /
+               ("broker-" + std::to_string(rd()));
+        std::filesystem::create_directories(path);
+    }
+    ~TmpDir() { std::filesystem::remove_all(path); }
+
+    std::filesystem::path path;
+};
+
+// Records the paths of the FileAdded actions it receives
+struct Client {
+    explicit Client(std::unique_ptr<pathwatch::PathWatcher::PIMPL> backend)
+        : watcher(std::move(backend)) {}
+
+    void watch(const std::filesystem::path& dir) {
+        watcher.watch(dir, [this](auto action) {
+            if constexpr (std::is_same_v<decltype(action), pathwatch::actions::FileAdded>) {
+                std::lock_guard<std::mutex> lock(mutex);
+                added_.push_back(action.path);
+            }
+        });
+    }
+
+    bool waitFor(const std::filesystem::path& path) {
+        for (int i = 0; i < 100; ++i) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (std::find(added_.begin(), added_.end(), path) != added_.end()) return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        return false;
+    }
+
+    pathwatch::PathWatcher watcher;
+    std::mutex mutex;
+    std::vector<std::filesystem::path> added_;
+};
+
+void touch(const std::filesystem::path& path) { std::ofstream off(path); }
+}  // namespace local
+
+TEST_CASE("Broker fan-out", "[broker]") {
+    local::TmpDir tmp;
+    const auto socket = tmp.path / "broker.sock";
+    const auto dir = tmp.path / "watched";
+    std::filesystem::create_directories(dir);
+
+    auto broker = std::make_unique<pathwatch::Broker>(socket);
+    REQUIRE_THROWS_AS(pathwatch::Broker(socket), pathwatch::Exception);
+
+    local::Client a(std::make_unique<pathwatch::BrokerBackend>(socket));
+    local::Client b(std::make_unique<pathwatch::BrokerBackend>(socket));
+    a.watch(dir);
+    b.watch(dir);
+    REQUIRE(broker->numberOfWatches() == 1);
+
+    for (auto name : {"first.txt", "second.txt"}) {
+        local::touch(dir / name);
+        REQUIRE(a.waitFor(dir / name));
+        REQUIRE(b.waitFor(dir / name));
+    }
+
+    SECTION("Clients fall back to native watches when the broker goes away") {
+        broker.reset();
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        local::touch(dir / "third.txt");
+        REQUIRE(a.waitFor(dir / "third.txt"));
+        REQUIRE(b.waitFor(dir / "third.txt"));
+    }
+}
+
+TEST_CASE("Broker connectOrNative", "[broker]") {
+    local::TmpDir tmp;
+    const auto socket = tmp.path / "broker.sock";
+
+    auto native = pathwatch::BrokerBackend::connectOrNative(socket);
+    REQUIRE(native);
+    REQUIRE(dynamic_cast<pathwatch::BrokerBackend*>(native.get()) == nullptr);
+
+    pathwatch::Broker broker(socket);
+    auto shared = pathwatch::BrokerBackend::connectOrNative(socket);
+    REQUIRE(dynamic_cast<pathwatch::BrokerBackend*>(shared.get()) != nullptr);
+}
+#endif
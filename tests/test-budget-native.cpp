@@ -0,0 +1,119 @@
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#include "catch2/catch.hpp"
+
+#include <pathwatch.h>
+
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+
+namespace local {
+struct TmpDir {
+    TmpDir() {
+        std::random_device rd;
+        path = std::filesystem::temp_directory_path() / "pathwatch-testing" /
+               ("budget-" + std::to_string(rd()));
+        std::filesystem::create_directories(path / "a");
+        std::filesystem::create_directories(path / "b");
+    }
+    ~TmpDir() { std::filesystem::remove_all(path); }
+
+    std::filesystem::path path;
+};
+
+// Records every action it receives as printed by operator<<
+struct Recorder {
+    void operator()(const pathwatch::PathWatcher::Action& action) {
+        std::ostringstream ss;
+        std::visit([&](const auto& a) { ss << a; }, action);
+        std::lock_guard<std::mutex> lock(mutex);
+        actions.push_back(ss.str());
+    }
+
+    bool waitFor(const std::string& expected) {
+        for (int i = 0; i < 100; ++i) {
+            if (seen(expected)) return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        return false;
+    }
+
+    bool seen(const std::string& expected) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::find(actions.begin(), actions.end(), expected) != actions.end();
+    }
+
+    std::mutex mutex;
+    std::vector<std::string> actions;
+};
+
+void touch(const std::filesystem::path& path) { std::ofstream off(path); }
+
+/**
+ * Creates and renames a file in dir and waits for the actions. Kernel watches report a FileRenamed, polling
+ * a FileRemoved and a FileAdded.
+ */
+bool isPolled(Recorder& recorder, const std::filesystem::path& dir, const std::string& name) {
+    touch(dir / name);
+    if (!recorder.waitFor(std::string("FileAdded ") + (dir / name).string())) {
+        throw std::runtime_error("No action for " + (dir / name).string());
+    }
+    std::filesystem::rename(dir / name, dir / (name + ".moved"));
+    auto added = std::string("FileAdded ") + (dir / (name + ".moved")).string();
+    auto renamed = std::string("FileRenamed ") + (dir / name).string() + " > " +
+                   (dir / (name + ".moved")).string();
+    for (int i = 0; i < 100; ++i) {
+        if (recorder.seen(renamed)) return false;
+        if (recorder.seen(added)) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    throw std::runtime_error("No rename action in " + dir.string());
+}
+}  // namespace local
+
+TEST_CASE("Watch budget", "[native][budget]") {
+    local::TmpDir tmp;
+    const auto a = tmp.path / "a";
+    const auto b = tmp.path / "b";
+
+    local::Recorder recorder;
+    pathwatch::PathWatcher watcher(pathwatch::PathWatcher::nativeBackend());
+
+    SECTION("Watches beyond the budget are polled") {
+        watcher.setWatchBudget(1, std::chrono::milliseconds(50));
+        watcher.watch(a, [&](auto action) { recorder(action); });
+        watcher.watch(b, [&](auto action) { recorder(action); });
+
+        REQUIRE_FALSE(local::isPolled(recorder, a, "1.txt"));
+        REQUIRE(local::isPolled(recorder, b, "1.txt"));
+    }
+
+    SECTION("Lowering the budget demotes the least recently active watch") {
+        watcher.watch(a, [&](auto action) { recorder(action); });
+        watcher.watch(b, [&](auto action) { recorder(action); });
+        REQUIRE_FALSE(local::isPolled(recorder, b, "1.txt"));
+        REQUIRE_FALSE(local::isPolled(recorder, a, "1.txt"));
+
+        // Checking a polled watch makes it busy enough to be promoted, so it goes last
+        watcher.setWatchBudget(1, std::chrono::milliseconds(50));
+        REQUIRE_FALSE(local::isPolled(recorder, a, "2.txt"));
+        REQUIRE(local::isPolled(recorder, b, "2.txt"));
+    }
+
+    SECTION("Busy polled watches are promoted") {
+        watcher.setWatchBudget(1, std::chrono::milliseconds(50));
+        watcher.watch(a, [&](auto action) { recorder(action); });
+        watcher.watch(b, [&](auto action) { recorder(action); });
+
+        for (auto name : {"1.txt", "2.txt"}) {
+            local::touch(b / name);
+            REQUIRE(recorder.waitFor(std::string("FileAdded ") + (b / name).string()));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        REQUIRE_FALSE(local::isPolled(recorder, b, "3.txt"));
+        REQUIRE(local::isPolled(recorder, a, "3.txt"));
+    }
+}
@@ -0,0 +1,90 @@
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#include "catch2/catch.hpp"
+
+#include <pathwatch.h>
+
+#include <array>
+#include <string>
+#include <vector>
+
+namespace local {
+// Counts live copies, a double destroy makes alive negative
+struct Counter {
+    Counter(int* alive) : alive(alive) { ++*alive; }
+    Counter(const Counter& rhs) noexcept : alive(rhs.alive) { ++*alive; }
+    ~Counter() { --*alive; }
+    int* alive;
+};
+}  // namespace local
+
+TEST_CASE("CallbackWrapperStorage", "[callback]") {
+    int calls = 0;
+    pathwatch::CallbackWrapper small([&](auto) { ++calls; });
+    REQUIRE(small.isInline());
+
+    std::array<char, 64> big{};
+    pathwatch::CallbackWrapper large([&calls, big](auto) { calls += 1 + big[0]; });
+    REQUIRE_FALSE(large.isInline());
+
+    small(pathwatch::actions::FileAdded{"a"});
+    large(pathwatch::actions::FileAdded{"a"});
+    REQUIRE(calls == 2);
+}
+
+TEST_CASE("CallbackWrapperLifetime", "[callback]") {
+    using namespace pathwatch::actions;
+    int alive = 0;
+    int calls = 0;
+    {
+        local::Counter counter(&alive);
+        std::array<char, 64> big{};
+        pathwatch::CallbackWrapper inl([counter, &calls](auto) { ++calls; });
+        pathwatch::CallbackWrapper heap([counter, big, &calls](auto) { calls += 1 + big[0]; });
+        REQUIRE(inl.isInline());
+        REQUIRE_FALSE(heap.isInline());
+        REQUIRE(alive == 3);
+
+        for (auto* w : {&inl, &heap}) {
+            calls = 0;
+            pathwatch::CallbackWrapper copy(*w);
+            REQUIRE(alive == 4);
+            pathwatch::CallbackWrapper moved(std::move(copy));
+            REQUIRE(alive == 4);
+            moved(FileAdded{"a"});
+
+            pathwatch::CallbackWrapper assigned([](auto) {});
+            assigned = moved;
+            REQUIRE(alive == 5);
+            assigned = std::move(moved);
+            REQUIRE(alive == 4);
+            auto& self = assigned;
+            assigned = self;
+            assigned = std::move(self);
+            REQUIRE(alive == 4);
+            assigned(FileRemoved{"a"});
+
+            std::vector<pathwatch::CallbackWrapper> many(10, assigned);
+            REQUIRE(alive == 14);
+            for (auto& m : many) m(FileModified{"a"});
+            REQUIRE(calls == 12);
+        }
+        REQUIRE(alive == 3);
+    }
+    REQUIRE(alive == 0);
+}
+
+TEST_CASE("CallbackWrapperGenericLambda", "[callback]") {
+    using namespace pathwatch::actions;
+    std::vector<std::string> got;
+    pathwatch::CallbackWrapper cb([&](auto action) {
+        using Got = std::decay_t<decltype(action)>;
+        got.push_back(Got::type);
+    });
+
+    cb(FileAdded{"a"});
+    cb(FileRemoved{"a"});
+    cb(FileModified{"a"});
+    cb(FileRenamed{"a", "b"});
+    REQUIRE(got == std::vector<std::string>{FileAdded::type, FileRemoved::type,
+                                            FileModified::type, FileRenamed::type});
+}
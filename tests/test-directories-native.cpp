@@ -0,0 +1,102 @@
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#include "catch2/catch.hpp"
+
+#include <pathwatch.h>
+
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+
+namespace local {
+struct TmpDir {
+    TmpDir() {
+        std::random_device rd;
+        path = std::filesystem::temp_directory_path() / "pathwatch-testing" /
+               ("directories-" + std::to_string(rd()));
+        std::filesystem::create_directories(path);
+    }
+    ~TmpDir() { std::filesystem::remove_all(path); }
+
+    std::filesystem::path path;
+};
+
+// Records every action it receives as printed by operator<<
+struct Recorder {
+    void operator()(const pathwatch::PathWatcher::Action& action) {
+        std::ostringstream ss;
+        std::visit([&](const auto& a) { ss << a; }, action);
+        std::lock_guard<std::mutex> lock(mutex);
+        actions.push_back(ss.str());
+    }
+
+    bool waitFor(const std::string& expected) {
+        for (int i = 0; i < 100; ++i) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (std::find(actions.begin(), actions.end(), expected) != actions.end()) {
+                    return true;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        return false;
+    }
+
+    std::mutex mutex;
+    std::vector<std::string> actions;
+};
+
+std::string added(const std::filesystem::path& p) { return std::string("FileAdded ") + p.string(); }
+std::string removed(const std::filesystem::path& p) {
+    return std::string("FileRemoved ") + p.string();
+}
+std::string renamed(const std::filesystem::path& from, const std::filesystem::path& to) {
+    return std::string("FileRenamed ") + from.string() + " > " + to.string();
+}
+}  // namespace local
+
+TEST_CASE("Subdirectory actions", "[native]") {
+    namespace fs = std::filesystem;
+    local::TmpDir tmp;
+    const auto dir = tmp.path;
+
+    local::Recorder recorder;
+    pathwatch::PathWatcher watcher(pathwatch::PathWatcher::nativeBackend());
+    watcher.watch(dir, [&](auto action) { recorder(action); });
+
+    fs::create_directory(dir / "sub");
+    REQUIRE(recorder.waitFor(local::added(dir / "sub")));
+
+    fs::rename(dir / "sub", dir / "moved");
+    REQUIRE(recorder.waitFor(local::renamed(dir / "sub", dir / "moved")));
+
+    fs::remove(dir / "moved");
+    REQUIRE(recorder.waitFor(local::removed(dir / "moved")));
+}
+
+TEST_CASE("Moves across the watched directory", "[native]") {
+    namespace fs = std::filesystem;
+    local::TmpDir tmp;
+    const auto dir = tmp.path / "watched";
+    const auto outside = tmp.path / "outside";
+    fs::create_directories(dir);
+    fs::create_directories(outside);
+    std::ofstream(outside / "in.txt") << "in";
+    std::ofstream(dir / "out.txt") << "out";
+
+    local::Recorder recorder;
+    pathwatch::PathWatcher watcher(pathwatch::PathWatcher::nativeBackend());
+    watcher.watch(dir, [&](auto action) { recorder(action); });
+
+    fs::rename(outside / "in.txt", dir / "in.txt");
+    REQUIRE(recorder.waitFor(local::added(dir / "in.txt")));
+
+    fs::rename(dir / "out.txt", outside / "out.txt");
+    REQUIRE(recorder.waitFor(local::removed(dir / "out.txt")));
+
+    // A later rename inside the directory must not pair with the moves above
+    fs::rename(dir / "in.txt", dir / "renamed.txt");
+    REQUIRE(recorder.waitFor(local::renamed(dir / "in.txt", dir / "renamed.txt")));
+}
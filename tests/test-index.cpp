@@ -0,0 +1,100 @@
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#include "catch2/catch.hpp"
+
+#include <pathwatch.h>
+#include <pw_simulated.h>
+
+#include <fstream>
+#include <random>
+
+namespace local {
+void writeTo(std::filesystem::path path, size_t bytes, std::filesystem::file_time_type mtime) {
+    {
+        std::ofstream off(path);
+        off << std::string(bytes, 'x');
+    }
+    std::filesystem::last_write_time(path, mtime);
+}
+
+struct TmpDir {
+    TmpDir() {
+        std::random_device rd;
+        path = std::filesystem::temp_directory_path() / "pathwatch-testing" /
+               ("index-" + std::to_string(rd()));
+        std::filesystem::create_directories(path);
+    }
+    ~TmpDir() { std::filesystem::remove_all(path); }
+
+    std::filesystem::path path;
+};
+}  // namespace local
+
+TEST_CASE("DirectoryIndex", "[index]") {
+    using namespace pathwatch::actions;
+    namespace fs = std::filesystem;
+
+    local::TmpDir tmp;
+    const auto root = tmp.path;
+    const auto t0 = fs::file_time_type::clock::now() - std::chrono::hours(1);
+    fs::create_directories(root / "sub");
+    local::writeTo(root / "a.txt", 5, t0 + std::chrono::seconds(100));
+    local::writeTo(root / "sub" / "b.txt", 10, t0);
+
+    auto backend = new pathwatch::SimulatedBackend();
+    pathwatch::PathWatcher watcher(std::unique_ptr<pathwatch::PathWatcher::PIMPL>{backend});
+    REQUIRE_THROWS_AS(watcher.aggregate(root), pathwatch::Exception);
+
+    watcher.index(root);
+    REQUIRE(backend->numberOfWatches() == 2);
+    REQUIRE(watcher.aggregate(root).bytes == 15);
+    REQUIRE(watcher.aggregate(root).files == 2);
+    REQUIRE(watcher.aggregate(root).newest == t0 + std::chrono::seconds(100));
+    REQUIRE(watcher.aggregate(root / "sub").bytes == 10);
+    REQUIRE(watcher.aggregate(root / "sub").newest == t0);
+
+    local::writeTo(root / "sub" / "c.txt", 3, t0 + std::chrono::seconds(50));
+    backend->post(FileAdded{root / "sub" / "c.txt"});
+    REQUIRE(watcher.aggregate(root).bytes == 18);
+    REQUIRE(watcher.aggregate(root / "sub").newest == t0 + std::chrono::seconds(50));
+
+    fs::create_directories(root / "sub" / "deep");
+    local::writeTo(root / "sub" / "deep" / "d.txt", 7, t0);
+    backend->post(FileAdded{root / "sub" / "deep"});
+    REQUIRE(backend->numberOfWatches() == 3);
+    REQUIRE(watcher.aggregate(root).bytes == 25);
+    REQUIRE(watcher.aggregate(root).files == 4);
+
+    local::writeTo(root / "sub" / "deep" / "d.txt", 1, t0 + std::chrono::seconds(200));
+    backend->post(FileModified{root / "sub" / "deep" / "d.txt"});
+    REQUIRE(watcher.aggregate(root).bytes == 19);
+    REQUIRE(watcher.aggregate(root).newest == t0 + std::chrono::seconds(200));
+
+    fs::rename(root / "sub", root / "moved");
+    backend->post(FileRenamed{root / "sub", root / "moved"});
+    REQUIRE_THROWS_AS(watcher.aggregate(root / "sub"), pathwatch::Exception);
+    REQUIRE(watcher.aggregate(root).bytes == 19);
+    REQUIRE(watcher.aggregate(root / "moved").files == 3);
+
+    // Moving back and forth must not leave extra index callbacks behind on the old paths
+    fs::rename(root / "moved", root / "sub");
+    backend->post(FileRenamed{root / "moved", root / "sub"});
+    fs::rename(root / "sub", root / "moved");
+    backend->post(FileRenamed{root / "sub", root / "moved"});
+    local::writeTo(root / "moved" / "e.txt", 2, t0);
+    backend->post(FileAdded{root / "moved" / "e.txt"});
+    REQUIRE(watcher.aggregate(root).bytes == 21);
+    REQUIRE(watcher.aggregate(root / "moved").files == 4);
+    fs::remove(root / "moved" / "e.txt");
+    backend->post(FileRemoved{root / "moved" / "e.txt"});
+
+    fs::remove_all(root / "moved" / "deep");
+    backend->post(FileRemoved{root / "moved" / "deep"});
+    REQUIRE(watcher.aggregate(root).bytes == 18);
+    REQUIRE(watcher.aggregate(root).newest == t0 + std::chrono::seconds(100));
+
+    fs::remove(root / "a.txt");
+    backend->post(FileRemoved{root / "a.txt"});
+    REQUIRE(watcher.aggregate(root).bytes == 13);
+    REQUIRE(watcher.aggregate(root).files == 2);
+    REQUIRE(watcher.aggregate(root).newest == t0 + std::chrono::seconds(50));
+}
@@ -0,0 +1,79 @@
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#include "catch2/catch.hpp"
+
+#include <pathwatch.h>
+#include <pw_simulated.h>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace local {
+struct Simulated {
+    Simulated()
+        : backend(new pathwatch::SimulatedBackend())
+        , watcher(std::unique_ptr<pathwatch::PathWatcher::PIMPL>(backend)) {}
+
+    pathwatch::SimulatedBackend* backend;
+    pathwatch::PathWatcher watcher;
+};
+}  // namespace local
+
+TEST_CASE("SimulatedDirectoryWatch", "[simulated]") {
+    using namespace pathwatch::actions;
+    local::Simulated sim;
+
+    std::vector<std::string> got;
+    sim.watcher.watch("/sim/dir/", [&](auto action) {
+        using Got = std::decay_t<decltype(action)>;
+        got.push_back(Got::type);
+    });
+
+    sim.backend->post(FileAdded{"/sim/dir/a.txt"});
+    sim.backend->post(FileModified{"/sim/dir/a.txt"});
+    sim.backend->post(FileAdded{"/sim/other/b.txt"});
+    sim.backend->post(FileAdded{"/sim/dir/sub/c.txt"});
+    sim.backend->post(FileRenamed{"/sim/dir/a.txt", "/sim/dir/b.txt"});
+    sim.backend->post(FileRemoved{"/sim/dir/b.txt"});
+
+    REQUIRE(got == std::vector<std::string>{FileAdded::type, FileModified::type,
+                                            FileRenamed::type, FileRemoved::type});
+}
+
+TEST_CASE("SimulatedFileWatch", "[simulated]") {
+    using namespace pathwatch::actions;
+    local::Simulated sim;
+
+    int count = 0;
+    sim.watcher.watch("/sim/dir/a.txt", [&](auto) { ++count; });
+
+    sim.backend->post(FileModified{"/sim/dir/a.txt"});
+    sim.backend->post(FileModified{"/sim/dir/b.txt"});
+    sim.backend->post(FileRenamed{"/sim/dir/a.txt", "/sim/dir/c.txt"});
+
+    REQUIRE(count == 2);
+}
+
+TEST_CASE("TraceRoundTrip", "[simulated]") {
+    using namespace pathwatch::actions;
+    std::vector<pathwatch::PathWatcher::Action> trace{
+        FileAdded{"/sim/dir/with space.txt"}, FileModified{"/sim/dir/with space.txt"},
+        FileRenamed{"/sim/dir/with space.txt", "/sim/dir/\"quoted\".txt"},
+        FileRemoved{"/sim/dir/\"quoted\".txt"}};
+
+    std::stringstream ss;
+    pathwatch::writeTrace(ss, trace);
+
+    local::Simulated sim;
+    std::vector<pathwatch::PathWatcher::Action> got;
+    sim.watcher.watch("/sim/dir", [&](auto action) { got.push_back(action); });
+    REQUIRE(sim.backend->replay(ss) == trace.size());
+
+    std::stringstream expected, actual;
+    pathwatch::writeTrace(expected, trace);
+    pathwatch::writeTrace(actual, got);
+    REQUIRE(expected.str() == actual.str());
+
+    std::istringstream bad("FileExploded \"/a\"\n");
+    REQUIRE_THROWS_AS(pathwatch::readTrace(bad), pathwatch::Exception);
+}